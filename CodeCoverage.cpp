@@ -1,10 +1,14 @@
 #include <cmath>
 #include <string>
 #include <map>
+#include <set>
+#include <sstream>
 #include <fstream>
 #include <iostream>
 #include <sys/stat.h>
 #include <regex>
+#include <chrono>
+#include <atomic>
 
 #include "pin.H"
 #include "util.h"
@@ -42,6 +46,101 @@ struct FileCodeCoverage
     std::vector<LineInfo> Lines;
 };
 
+// size of first target table of indirect call site, must be power of 2
+#define CALL_TARGET_TABLE_SIZE 16
+// each chained table is this times larger than the previous one
+#define CALL_TARGET_TABLE_GROWTH 4
+// slots probed in a table before moving on to the next table
+#define CALL_TARGET_MAX_PROBE 8
+
+// lock-free open-addressed table of observed targets of indirect call site.
+// slots are never cleared, when the probe window of a target is taken by other targets
+// it goes to the next larger table, which is appended by CAS on Next
+struct CallTargetTable
+{
+    UINT32 Size;
+    std::atomic<ADDRINT> *Slots;   // 0 means empty slot
+    std::atomic<CallTargetTable *> Next;
+};
+
+struct CallSiteCoverage
+{
+    ADDRINT DirectTarget;               // 0 for indirect call
+    CallTargetTable *IndirectTargets;   // nullptr for direct call
+};
+
+struct ToolStats
+{
+    // wall time per phase (usec)
+    UINT64 ImageLoadTime;
+    UINT64 InstrumentTime;
+    UINT64 ReportTime;
+    UINT64 IndexReportTime;
+
+    // static counts collected in ImageLoad
+    UINT32 ImageCount;
+    UINT32 RoutineCount;
+    UINT64 StaticInsCount;
+
+    // JIT and runtime counts
+    UINT64 InstrumentedInsCount;
+    UINT64 TraceCount;
+    // sum of ThreadStats, aggregated at report time
+    UINT64 AnalysisCallCount;
+};
+
+// Pin reuses THREADID of exited threads, so live threads stay below this in practice.
+// threads beyond it share slots and may lose counts
+#define MAX_STATS_THREADS 1024
+
+// counters updated by analysis routines, padded to cache line to avoid false sharing
+struct alignas(64) ThreadStats
+{
+    UINT64 AnalysisCallCount;
+    // instrumented instructions since s_newLineEpoch changed, counted only with -saturation_ins
+    UINT64 InsSinceNewLine;
+    UINT64 NewLineEpoch;
+};
+
+// accumulate elapsed wall time of the enclosing scope to counter
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(UINT64 &counter)
+        : m_counter(counter), m_start(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~ScopedTimer()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - m_start;
+        m_counter += std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    }
+
+private:
+    UINT64 &m_counter;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+static UINT64 getTimeUsec()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+// =====================================================================
+// Knobs
+// =====================================================================
+static KNOB<BOOL> KnobCallEdges(KNOB_MODE_WRITEONCE, "pintool", "call_edges", "1",
+    "record call edges(call site -> target routine) of each call instruction");
+static KNOB<UINT32> KnobSaturationSec(KNOB_MODE_WRITEONCE, "pintool", "saturation_sec", "0",
+    "write report and detach when no new line is covered for N seconds, counted from the first covered line (0: disabled)");
+static KNOB<UINT64> KnobSaturationIns(KNOB_MODE_WRITEONCE, "pintool", "saturation_ins", "0",
+    "write report and detach when no new line is covered while a thread executes N instrumented instructions "
+    "(instructions of functions with debug info) (0: disabled)");
+static KNOB<UINT32> KnobWindowSec(KNOB_MODE_WRITEONCE, "pintool", "window_sec", "0",
+    "write report and detach N seconds after the tool starts, e.g. when attached by -pid (0: disabled)");
+
 // =====================================================================
 // Global Variables
 // =====================================================================
@@ -50,6 +149,40 @@ static std::map<std::string, FileCodeCoverage> s_fileCodeCoverageMap;
 static std::map<std::string, std::string> s_funcFileMap;
 
 static std::map<ADDRINT, std::string> s_addrFuncNameMap;
+static std::map<ADDRINT, CallSiteCoverage> s_callSiteMap;
+static ToolStats s_toolStats = {};
+static ThreadStats s_threadStats[MAX_STATS_THREADS] = {};
+
+// saturation policy
+static UINT64 s_saturationIns = 0;
+// incremented when any thread covers a new line, threads restart InsSinceNewLine on change
+static std::atomic<UINT64> s_newLineEpoch(0);
+static UINT64 s_startTime = 0;
+// 0 until the first line is covered, so that time spent before the target runs is not counted
+static std::atomic<UINT64> s_lastNewLineTime(0);
+static std::atomic<bool> s_detachRequested(false);
+static std::atomic<bool> s_watchdogStop(false);
+static PIN_THREAD_UID s_watchdogThreadUid;
+static bool s_reportGenerated = false;
+
+static CallTargetTable *newCallTargetTable(UINT32 size)
+{
+    CallTargetTable *table = new CallTargetTable;
+    table->Size = size;
+    table->Slots = new std::atomic<ADDRINT>[size];
+    for (UINT32 i = 0; i < size; i++)
+    {
+        table->Slots[i].store(0, std::memory_order_relaxed);
+    }
+    table->Next.store(nullptr, std::memory_order_relaxed);
+    return table;
+}
+
+static void deleteCallTargetTable(CallTargetTable *table)
+{
+    delete[] table->Slots;
+    delete table;
+}
 
 static void ImageLoad(IMG img, void *v)
 {
@@ -57,7 +190,10 @@ static void ImageLoad(IMG img, void *v)
     {
         return;
     }
-    
+
+    ScopedTimer timer(s_toolStats.ImageLoadTime);
+    s_toolStats.ImageCount++;
+
     if (IMG_IsMainExecutable(img))
     {
         s_targetName = IMG_Name(img);
@@ -118,9 +254,11 @@ static void ImageLoad(IMG img, void *v)
 
             FuncCodeCoverage funcCodeCoverage;
             const std::string &funcName = RTN_Name(rtn);
+            s_toolStats.RoutineCount++;
             RTN_Open(rtn);
             for (INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins))
             {
+                s_toolStats.StaticInsCount++;
                 addr = INS_Address(ins);
                 PIN_GetSourceLocation(addr, &col, &line, &filePath);
 
@@ -138,6 +276,21 @@ static void ImageLoad(IMG img, void *v)
                 funcCodeCoverage.LineCoveredMap[line]   = false;
                 funcCodeCoverage.InsCoveredMap[addr]    = false;
                 funcCodeCoverage.AddrAsmMap[addr]       = INS_Disassemble(ins);
+
+                // existing entry is never reset, its table may already be passed to analysis routine
+                if (KnobCallEdges.Value() && INS_IsCall(ins) && s_callSiteMap.find(addr) == s_callSiteMap.end())
+                {
+                    CallSiteCoverage callSite{0, nullptr};
+                    if (INS_IsDirectControlFlow(ins))
+                    {
+                        callSite.DirectTarget = INS_DirectControlFlowTargetAddress(ins);
+                    }
+                    else
+                    {
+                        callSite.IndirectTargets = newCallTargetTable(CALL_TARGET_TABLE_SIZE);
+                    }
+                    s_callSiteMap.emplace(addr, callSite);
+                }
             }
 
             funcCodeCoverage.TotalLineCount = funcCodeCoverage.LineCoveredMap.size();
@@ -152,8 +305,81 @@ static void ImageLoad(IMG img, void *v)
     return;
 }
 
-static VOID updateCoverage(ADDRINT addr)
+static VOID requestDetach(const std::string &reason)
 {
+    if (s_detachRequested.exchange(true))
+    {
+        // already requested by other thread
+        return;
+    }
+
+    std::cout << "[CodeCoverage] Coverage saturated (" << reason << "), detaching..." << std::endl;
+
+    // report is generated in DetachCallback, Fini is not called after detach
+    PIN_Detach();
+}
+
+static VOID recordCallEdge(CallTargetTable *table, ADDRINT target, THREADID tid)
+{
+    s_threadStats[tid % MAX_STATS_THREADS].AnalysisCallCount++;
+
+    // routine entries are aligned, mix upper bits into the slot index
+    UINT32 hash = (UINT32)((target >> 4) ^ (target >> 12));
+    while (true)
+    {
+        for (UINT32 i = 0; i < CALL_TARGET_MAX_PROBE; i++)
+        {
+            std::atomic<ADDRINT> &slot = table->Slots[(hash + i) & (table->Size - 1)];
+            ADDRINT current = slot.load(std::memory_order_relaxed);
+            if (current == target)
+            {
+                return;
+            }
+
+            if (current == 0)
+            {
+                // claim empty slot, other thread may have stored the same target meanwhile
+                if (slot.compare_exchange_strong(current, target, std::memory_order_release, std::memory_order_relaxed)
+                    || current == target)
+                {
+                    return;
+                }
+            }
+        }
+
+        // probe window is taken by other targets, megamorphic site continues in the next table
+        CallTargetTable *next = table->Next.load(std::memory_order_acquire);
+        if (next == nullptr)
+        {
+            CallTargetTable *newTable = newCallTargetTable(table->Size * CALL_TARGET_TABLE_GROWTH);
+            if (table->Next.compare_exchange_strong(next, newTable, std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                next = newTable;
+            }
+            else
+            {
+                // other thread appended first, next holds its table
+                deleteCallTargetTable(newTable);
+            }
+        }
+        table = next;
+    }
+}
+
+static VOID updateCoverage(ADDRINT addr, THREADID tid)
+{
+    ThreadStats &threadStats = s_threadStats[tid % MAX_STATS_THREADS];
+    threadStats.AnalysisCallCount++;
+    if (s_saturationIns != 0)
+    {
+        UINT64 epoch = s_newLineEpoch.load(std::memory_order_relaxed);
+        if (threadStats.NewLineEpoch != epoch)
+        {
+            threadStats.NewLineEpoch = epoch;
+            threadStats.InsSinceNewLine = 0;
+        }
+        threadStats.InsSinceNewLine++;
+    }
     if (s_addrFuncNameMap.find(addr) == s_addrFuncNameMap.end())
     {
         return;
@@ -177,6 +403,16 @@ static VOID updateCoverage(ADDRINT addr)
         s_fileCodeCoverageMap[filePath].Lines[line - 1].Covered = true;
         s_fileCodeCoverageMap[filePath].FuncCodeCoverageMap[funcName].LineCoveredMap[line] = true;
         s_fileCodeCoverageMap[filePath].FuncCodeCoverageMap[funcName].CoveredLineCount++;
+        if (s_saturationIns != 0)
+        {
+            s_newLineEpoch.fetch_add(1, std::memory_order_relaxed);
+        }
+        s_lastNewLineTime = getTimeUsec();
+    }
+    else if (s_saturationIns != 0 && s_saturationIns <= threadStats.InsSinceNewLine
+             && !s_detachRequested.load(std::memory_order_relaxed))
+    {
+        requestDetach("no new line covered for " + std::to_string(threadStats.InsSinceNewLine) + " instrumented instructions");
     }
 }
 
@@ -217,7 +453,241 @@ static std::string encodeHtml(const std::string &text)
     return encodedText;
 }
 
-static void generateIndexHtml(const std::string &filePath, const std::string &targetModule)
+static std::string formatAddr(ADDRINT addr)
+{
+    std::stringstream ss;
+    ss << "0x" << std::hex << addr;
+    return ss.str();
+}
+
+static std::string makeCallTargetName(ADDRINT target)
+{
+    std::string name = RTN_FindNameByAddress(target);
+    if (name == "")
+    {
+        return formatAddr(target);
+    }
+    return formatAddr(target) + " " + name;
+}
+
+static std::set<ADDRINT> collectCallTargets(const CallTargetTable *table)
+{
+    std::set<ADDRINT> targets;
+    for (; table != nullptr; table = table->Next.load(std::memory_order_acquire))
+    {
+        for (UINT32 i = 0; i < table->Size; i++)
+        {
+            ADDRINT target = table->Slots[i].load(std::memory_order_acquire);
+            if (target != 0)
+            {
+                targets.insert(target);
+            }
+        }
+    }
+    return targets;
+}
+
+struct CallEdgeSummary
+{
+    UINT32 CoveredEdgeCount;
+    UINT32 TotalEdgeCount;
+    std::vector<std::string> UncoveredEdges;
+};
+
+static CallEdgeSummary summarizeCallEdges(const FuncCodeCoverage &funcCodeCoverage)
+{
+    CallEdgeSummary summary{0, 0, {}};
+    for (const auto &insEntry : funcCodeCoverage.InsCoveredMap)
+    {
+        auto it = s_callSiteMap.find(insEntry.first);
+        if (it == s_callSiteMap.end())
+        {
+            continue;
+        }
+
+        const CallSiteCoverage &callSite = it->second;
+        if (callSite.IndirectTargets == nullptr)
+        {
+            summary.TotalEdgeCount++;
+            if (insEntry.second)
+            {
+                summary.CoveredEdgeCount++;
+            }
+            else
+            {
+                summary.UncoveredEdges.push_back(formatAddr(insEntry.first) + " -> " + makeCallTargetName(callSite.DirectTarget));
+            }
+            continue;
+        }
+
+        std::set<ADDRINT> targets = collectCallTargets(callSite.IndirectTargets);
+        if (targets.empty())
+        {
+            // targets of indirect call are unknown until it is executed, count the site as one edge
+            summary.TotalEdgeCount++;
+            summary.UncoveredEdges.push_back(formatAddr(insEntry.first) + " -> (indirect)");
+        }
+        else
+        {
+            summary.TotalEdgeCount += targets.size();
+            summary.CoveredEdgeCount += targets.size();
+        }
+    }
+    return summary;
+}
+
+// rough heap usage of std::map, assumes red-black tree node (3 pointers + color) per entry
+template<typename K, typename V>
+static UINT64 estimateMapBytes(const std::map<K, V> &m)
+{
+    return m.size() * (sizeof(typename std::map<K, V>::value_type) + 4 * sizeof(void *));
+}
+
+// heap bytes of std::string, short string stored inside the object is already counted by sizeof
+static UINT64 estimateStringHeapBytes(const std::string &text)
+{
+    const char *object = reinterpret_cast<const char *>(&text);
+    if (object <= text.data() && text.data() < object + sizeof(text))
+    {
+        return 0;
+    }
+    return text.capacity() + 1;
+}
+
+static std::vector<std::pair<std::string, UINT64>> collectMemoryStats()
+{
+    UINT64 sourceLinesBytes = 0;
+    UINT64 addrLineMapBytes = 0;
+    UINT64 addrAsmMapBytes = 0;
+    UINT64 lineCoveredMapBytes = 0;
+    UINT64 insCoveredMapBytes = 0;
+    for (const auto &fileEntry : s_fileCodeCoverageMap)
+    {
+        const FileCodeCoverage &fileCodeCoverage = fileEntry.second;
+        sourceLinesBytes += fileCodeCoverage.Lines.capacity() * sizeof(LineInfo);
+        for (const auto &line : fileCodeCoverage.Lines)
+        {
+            sourceLinesBytes += estimateStringHeapBytes(line.Text);
+        }
+
+        for (const auto &funcEntry : fileCodeCoverage.FuncCodeCoverageMap)
+        {
+            const FuncCodeCoverage &funcCodeCoverage = funcEntry.second;
+            addrLineMapBytes += estimateMapBytes(funcCodeCoverage.AddrLineMap);
+            addrAsmMapBytes += estimateMapBytes(funcCodeCoverage.AddrAsmMap);
+            for (const auto &asmEntry : funcCodeCoverage.AddrAsmMap)
+            {
+                addrAsmMapBytes += estimateStringHeapBytes(asmEntry.second);
+            }
+            lineCoveredMapBytes += estimateMapBytes(funcCodeCoverage.LineCoveredMap);
+            insCoveredMapBytes += estimateMapBytes(funcCodeCoverage.InsCoveredMap);
+        }
+    }
+
+    std::vector<std::pair<std::string, UINT64>> memoryStats;
+    memoryStats.push_back(std::make_pair("Lines", sourceLinesBytes));
+    memoryStats.push_back(std::make_pair("AddrLineMap", addrLineMapBytes));
+    memoryStats.push_back(std::make_pair("AddrAsmMap", addrAsmMapBytes));
+    memoryStats.push_back(std::make_pair("LineCoveredMap", lineCoveredMapBytes));
+    memoryStats.push_back(std::make_pair("InsCoveredMap", insCoveredMapBytes));
+
+    UINT64 funcFileMapBytes = estimateMapBytes(s_funcFileMap);
+    for (const auto &entry : s_funcFileMap)
+    {
+        funcFileMapBytes += estimateStringHeapBytes(entry.first);
+        funcFileMapBytes += estimateStringHeapBytes(entry.second);
+    }
+
+    // function name is held for each instruction
+    UINT64 addrFuncNameMapBytes = estimateMapBytes(s_addrFuncNameMap);
+    for (const auto &entry : s_addrFuncNameMap)
+    {
+        addrFuncNameMapBytes += estimateStringHeapBytes(entry.second);
+    }
+
+    memoryStats.push_back(std::make_pair("s_funcFileMap", funcFileMapBytes));
+    memoryStats.push_back(std::make_pair("s_addrFuncNameMap", addrFuncNameMapBytes));
+
+    UINT64 callSiteMapBytes = estimateMapBytes(s_callSiteMap);
+    for (const auto &callSiteEntry : s_callSiteMap)
+    {
+        const CallTargetTable *table = callSiteEntry.second.IndirectTargets;
+        for (; table != nullptr; table = table->Next.load(std::memory_order_acquire))
+        {
+            callSiteMapBytes += sizeof(CallTargetTable) + table->Size * sizeof(ADDRINT);
+        }
+    }
+    memoryStats.push_back(std::make_pair("s_callSiteMap", callSiteMapBytes));
+    return memoryStats;
+}
+
+static void writeStatsRow(std::ofstream &indexHtml, const std::string &item, UINT64 value)
+{
+    indexHtml << "<tr>" << std::endl;
+    indexHtml << StringHelper::strprintf("<td class='left'>%s</td>", item) << std::endl;
+    indexHtml << "<td class='right'>" << value << "</td>" << std::endl;
+    indexHtml << "</tr>" << std::endl;
+}
+
+static void generateStatsHtml(std::ofstream &indexHtml, const std::vector<std::pair<std::string, UINT64>> &memoryStats)
+{
+    indexHtml << "<h3>tool statistics</h3>" << std::endl;
+    indexHtml << "<table>" << std::endl;
+    indexHtml << "<thead>" << std::endl;
+    indexHtml << "<tr>" << std::endl;
+    indexHtml << "<th>item</th>" << std::endl;
+    indexHtml << "<th>value</th>" << std::endl;
+    indexHtml << "</tr>" << std::endl;
+    indexHtml << "</thead>" << std::endl;
+    indexHtml << "<tbody>" << std::endl;
+    writeStatsRow(indexHtml, "ImageLoad time(usec)", s_toolStats.ImageLoadTime);
+    writeStatsRow(indexHtml, "Instrumentation time(usec)", s_toolStats.InstrumentTime);
+    writeStatsRow(indexHtml, "Report generation time(usec, source and disassemble pages)", s_toolStats.ReportTime);
+    writeStatsRow(indexHtml, "images", s_toolStats.ImageCount);
+    writeStatsRow(indexHtml, "routines", s_toolStats.RoutineCount);
+    writeStatsRow(indexHtml, "static instructions", s_toolStats.StaticInsCount);
+    writeStatsRow(indexHtml, "instrumented instructions", s_toolStats.InstrumentedInsCount);
+    writeStatsRow(indexHtml, "traces", s_toolStats.TraceCount);
+    writeStatsRow(indexHtml, "analysis calls", s_toolStats.AnalysisCallCount);
+    writeStatsRow(indexHtml, "code cache used(bytes)", CODECACHE_CodeMemUsed());
+    for (const auto &entry : memoryStats)
+    {
+        writeStatsRow(indexHtml, entry.first + " memory(bytes, estimated)", entry.second);
+    }
+    indexHtml << "</tbody>" << std::endl;
+    indexHtml << "</table>" << std::endl;
+}
+
+static void generateStatsJson(const std::string &filePath, const std::vector<std::pair<std::string, UINT64>> &memoryStats)
+{
+    std::ofstream statsJson(filePath);
+    statsJson << "{" << std::endl;
+    statsJson << "    \"time_usec\": {" << std::endl;
+    statsJson << "        \"image_load\": " << s_toolStats.ImageLoadTime << "," << std::endl;
+    statsJson << "        \"instrumentation\": " << s_toolStats.InstrumentTime << "," << std::endl;
+    statsJson << "        \"report\": " << s_toolStats.ReportTime << "," << std::endl;
+    statsJson << "        \"index_report\": " << s_toolStats.IndexReportTime << std::endl;
+    statsJson << "    }," << std::endl;
+    statsJson << "    \"images\": " << s_toolStats.ImageCount << "," << std::endl;
+    statsJson << "    \"routines\": " << s_toolStats.RoutineCount << "," << std::endl;
+    statsJson << "    \"static_instructions\": " << s_toolStats.StaticInsCount << "," << std::endl;
+    statsJson << "    \"instrumented_instructions\": " << s_toolStats.InstrumentedInsCount << "," << std::endl;
+    statsJson << "    \"traces\": " << s_toolStats.TraceCount << "," << std::endl;
+    statsJson << "    \"analysis_calls\": " << s_toolStats.AnalysisCallCount << "," << std::endl;
+    statsJson << "    \"code_cache_bytes\": " << CODECACHE_CodeMemUsed() << "," << std::endl;
+    statsJson << "    \"memory_bytes\": {" << std::endl;
+    for (size_t i = 0; i < memoryStats.size(); i++)
+    {
+        statsJson << "        \"" << memoryStats[i].first << "\": " << memoryStats[i].second;
+        statsJson << ((i + 1 < memoryStats.size()) ? "," : "") << std::endl;
+    }
+    statsJson << "    }" << std::endl;
+    statsJson << "}" << std::endl;
+    statsJson.close();
+}
+
+static void generateIndexHtml(const std::string &filePath, const std::string &targetModule,
+                              const std::vector<std::pair<std::string, UINT64>> &memoryStats)
 {
     std::ofstream indexHtml(filePath);
     indexHtml << "<html><head>" << std::endl;
@@ -267,6 +737,11 @@ static void generateIndexHtml(const std::string &filePath, const std::string &ta
         indexHtml << "<th>function name</th>" << std::endl;
         indexHtml << "<th>function coverage(%)</th>" << std::endl;
         indexHtml << "<th>executed / total(lines)</th>" << std::endl;
+        if (KnobCallEdges.Value())
+        {
+            indexHtml << "<th>executed / total(call edges)</th>" << std::endl;
+            indexHtml << "<th>uncovered call edges</th>" << std::endl;
+        }
         indexHtml << "</tr>" << std::endl;
         indexHtml << "</thead>" << std::endl;
         indexHtml << "<tbody>" << std::endl;
@@ -285,12 +760,24 @@ static void generateIndexHtml(const std::string &filePath, const std::string &ta
             indexHtml << StringHelper::strprintf("<td class='left'>%s</td>", funcName) << std::endl;
             indexHtml << StringHelper::strprintf("<td class='center'>%d%</td>", coveredRate) << std::endl;
             indexHtml << StringHelper::strprintf("<td class='center'>%d / %d</td>", coveredLineCount, totalLineCount) << std::endl;
+            if (KnobCallEdges.Value())
+            {
+                CallEdgeSummary summary = summarizeCallEdges(funcCodeCoverage.second);
+                indexHtml << StringHelper::strprintf("<td class='center'>%u / %u</td>", summary.CoveredEdgeCount, summary.TotalEdgeCount) << std::endl;
+                indexHtml << "<td class='left'>";
+                for (size_t i = 0; i < summary.UncoveredEdges.size(); i++)
+                {
+                    indexHtml << ((i == 0) ? "" : "<br>") << encodeHtml(summary.UncoveredEdges[i]);
+                }
+                indexHtml << "</td>" << std::endl;
+            }
             indexHtml << "</tr>" << std::endl;
         }
         indexHtml << "</tbody>" << std::endl;
         indexHtml << "</table>" << std::endl;
         
     }
+    generateStatsHtml(indexHtml, memoryStats);
     indexHtml << "</body></html>" << std::endl;
     indexHtml.close();
 }
@@ -548,6 +1035,40 @@ void generateAsmHtml(std::string asmReportFilePath, std::string filePath, const
                 asmHtml << "    <td class='code'></td>" << std::endl;
             }
             asmHtml << "</tr>" << std::endl;
+
+            // observed targets of call instruction
+            auto callSiteIt = s_callSiteMap.find(addr);
+            if (callSiteIt != s_callSiteMap.end())
+            {
+                const CallSiteCoverage &callSite = callSiteIt->second;
+                std::vector<std::pair<std::string, bool>> targets;
+                if (callSite.IndirectTargets == nullptr)
+                {
+                    targets.push_back(std::make_pair(makeCallTargetName(callSite.DirectTarget), funcCodeCoverage.InsCoveredMap[addr]));
+                }
+                else
+                {
+                    std::set<ADDRINT> observedTargets = collectCallTargets(callSite.IndirectTargets);
+                    if (observedTargets.empty())
+                    {
+                        targets.push_back(std::make_pair(std::string("(no target observed)"), false));
+                    }
+                    for (ADDRINT target : observedTargets)
+                    {
+                        targets.push_back(std::make_pair(makeCallTargetName(target), true));
+                    }
+                }
+
+                for (const auto &target : targets)
+                {
+                    asmHtml << (target.second ? "<tr class='covered-line'>" : "<tr class='not-covered-line'>") << std::endl;
+                    asmHtml << "    <td class='ins-addr'></td>" << std::endl;
+                    asmHtml << "    <td class='mnemonic' colspan='3'>" << std::endl;
+                    asmHtml << "    <pre>  -&gt; " << encodeHtml(target.first) << "</pre>" << std::endl;
+                    asmHtml << "    </td>" << std::endl;
+                    asmHtml << "</tr>" << std::endl;
+                }
+            }
         }
         asmHtml << "</tbody>" << std::endl;
         asmHtml << "</table>" << std::endl;
@@ -561,6 +1082,7 @@ void generateAsmHtml(std::string asmReportFilePath, std::string filePath, const
 
 static VOID Instruction(INS ins, VOID *v)
 {
+    ScopedTimer timer(s_toolStats.InstrumentTime);
     ADDRINT addr = INS_Address(ins);
     std::string funcName = RTN_FindNameByAddress(addr);
     if (funcName == "")
@@ -584,14 +1106,34 @@ static VOID Instruction(INS ins, VOID *v)
         return;
     }
 
-    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)updateCoverage, IARG_ADDRINT, addr, IARG_END);
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)updateCoverage, IARG_ADDRINT, addr, IARG_THREAD_ID, IARG_END);
+    s_toolStats.InstrumentedInsCount++;
+
+    // target of direct call is known statically, only indirect call needs analysis
+    auto callSiteIt = s_callSiteMap.find(addr);
+    if (callSiteIt != s_callSiteMap.end() && callSiteIt->second.IndirectTargets != nullptr)
+    {
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)recordCallEdge,
+                       IARG_PTR, callSiteIt->second.IndirectTargets,
+                       IARG_BRANCH_TARGET_ADDR,
+                       IARG_THREAD_ID,
+                       IARG_END);
+    }
+}
+
+static VOID TraceInserted(TRACE trace, VOID *v)
+{
+    s_toolStats.TraceCount++;
 }
 
-VOID Fini(INT32 code, VOID* v)
+static VOID generateReport()
 {
-    std::cout << "[CodeCoverage] Program trace Finished, generating Coverage report..." << std::endl;
+    if (s_reportGenerated)
+    {
+        return;
+    }
+    s_reportGenerated = true;
 
-    // generate index.html
     struct stat st;
     int ret = stat("report", &st);
     if (ret < 0)
@@ -600,19 +1142,82 @@ VOID Fini(INT32 code, VOID* v)
         mkdir("report", 0755);
     }
 
-    generateIndexHtml("report/index.html", s_targetName);
-
     // generate each source file html
-    for (auto &entry : s_fileCodeCoverageMap)
     {
-        std::string sourceFilePath = entry.first;
-        FileCodeCoverage &fileCodeCoverage = entry.second;
-        std::string reportFilePath    = "report/" + makeReportFileName(sourceFilePath);
-        std::string asmReportFilePath = "report/" + makeAsmReportFileName(sourceFilePath);
-        generateSourceFileHtml(reportFilePath, sourceFilePath, fileCodeCoverage);
-        generateAsmHtml(asmReportFilePath, sourceFilePath, fileCodeCoverage);
+        ScopedTimer timer(s_toolStats.ReportTime);
+        for (auto &entry : s_fileCodeCoverageMap)
+        {
+            std::string sourceFilePath = entry.first;
+            FileCodeCoverage &fileCodeCoverage = entry.second;
+            std::string reportFilePath    = "report/" + makeReportFileName(sourceFilePath);
+            std::string asmReportFilePath = "report/" + makeAsmReportFileName(sourceFilePath);
+            generateSourceFileHtml(reportFilePath, sourceFilePath, fileCodeCoverage);
+            generateAsmHtml(asmReportFilePath, sourceFilePath, fileCodeCoverage);
+        }
     }
 
+    s_toolStats.AnalysisCallCount = 0;
+    for (const auto &threadStats : s_threadStats)
+    {
+        s_toolStats.AnalysisCallCount += threadStats.AnalysisCallCount;
+    }
+    std::vector<std::pair<std::string, UINT64>> memoryStats = collectMemoryStats();
+
+    // generate index.html and stats.json last so that they include time of the pages above,
+    // index.html can not contain its own generation time, it is written to stats.json only
+    {
+        ScopedTimer timer(s_toolStats.IndexReportTime);
+        generateIndexHtml("report/index.html", s_targetName, memoryStats);
+    }
+    generateStatsJson("report/stats.json", memoryStats);
+}
+
+static VOID Watchdog(VOID *v)
+{
+    UINT64 saturationUsec = (UINT64)KnobSaturationSec.Value() * 1000 * 1000;
+    UINT64 windowUsec = (UINT64)KnobWindowSec.Value() * 1000 * 1000;
+    while (!s_watchdogStop)
+    {
+        PIN_Sleep(100);
+        // load last time first, app thread may update it after now is taken
+        UINT64 lastNewLineTime = s_lastNewLineTime;
+        UINT64 now = getTimeUsec();
+        if (saturationUsec != 0 && lastNewLineTime != 0 && lastNewLineTime < now
+            && saturationUsec <= now - lastNewLineTime)
+        {
+            requestDetach("no new line covered for " + std::to_string(KnobSaturationSec.Value()) + " seconds");
+            break;
+        }
+        if (windowUsec != 0 && windowUsec <= now - s_startTime)
+        {
+            requestDetach("collection window of " + std::to_string(KnobWindowSec.Value()) + " seconds elapsed");
+            break;
+        }
+    }
+}
+
+static VOID PrepareForFini(VOID *v)
+{
+    // internal thread must exit before Fini is called
+    s_watchdogStop = true;
+    if (s_watchdogThreadUid != 0)
+    {
+        PIN_WaitForThreadTermination(s_watchdogThreadUid, PIN_INFINITE_TIMEOUT, NULL);
+    }
+}
+
+static VOID DetachCallback(VOID *v)
+{
+    s_watchdogStop = true;
+    std::cout << "[CodeCoverage] Detached from target, generating Coverage report..." << std::endl;
+    generateReport();
+    std::cout << "[CodeCoverage] Coverage Report generated. Please check `report/index.html' using your browser." << std::endl;
+}
+
+VOID Fini(INT32 code, VOID* v)
+{
+    std::cout << "[CodeCoverage] Program trace Finished, generating Coverage report..." << std::endl;
+    generateReport();
     std::cout << "[CodeCoverage] Coverage Report generated. Please check `report/index.html' using your browser." << std::endl;
     return;
 }
@@ -627,7 +1232,22 @@ int main(int argc, char **argv)
 
     IMG_AddInstrumentFunction(ImageLoad, 0);
     INS_AddInstrumentFunction(Instruction, 0);
+    CODECACHE_AddTraceInsertedFunction(TraceInserted, 0);
     PIN_AddFiniFunction(Fini, 0);
+    PIN_AddDetachFunction(DetachCallback, 0);
+
+    s_startTime = getTimeUsec();
+    s_saturationIns = KnobSaturationIns.Value();
+    if (KnobSaturationSec.Value() != 0 || KnobWindowSec.Value() != 0)
+    {
+        PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
+        THREADID tid = PIN_SpawnInternalThread(Watchdog, 0, 0, &s_watchdogThreadUid);
+        if (tid == INVALID_THREADID)
+        {
+            std::cerr << "[CodeCoverage] Failed to start watchdog thread" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
 
     std::cout << "[CodeCoverage] Program trace Start" << std::endl;
 